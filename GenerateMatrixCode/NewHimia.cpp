@@ -6,6 +6,13 @@
 #include <vector>
 #include <map>
 #include <numeric>
+#include <queue>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 #define LOG(...) handleLog(#__VA_ARGS__, __VA_ARGS__)
@@ -422,6 +429,44 @@ vector<Molecule> loadStr(string filename) {
     return ret;
 }
 
+// читает одну запись sdf (до "$$$$" включительно), false если записей больше нет
+bool readSdfRecord(istream& file, Molecule& mol) {
+    mol = Molecule();
+    string line;
+    stringstream ss;
+    int bondCount;
+    getline(file, line);
+    if (line == "") {
+        return false;
+    }
+    mol.name = line;
+    getline(file, line);
+    getline(file, line);
+    getline(file, line);
+    ss.str(line);
+    ss >> mol.atomCount >> bondCount;
+    for (int i = 0; i < mol.atomCount; i++) {
+        Atom a;
+        a.hydrogenCount = 0;
+        getline(file, line);
+        ss.str(line);
+        ss >> a.x >> a.y >> a.z >> a.name;
+        a.index = i;
+        mol.atoms.push_back(a);
+    }
+    for (int i = 0; i < bondCount; i++) {
+        Link l;
+        getline(file, line);
+        ss.str(line);
+        ss >> l.fst >> l.snd >> l.type;
+        l.fst--;
+        l.snd--;
+        mol.links.push_back(l);
+    }
+    while (getline(file, line) && line != "$$$$");
+    return true;
+}
+
 vector<Molecule> loadSdf(string filename) {
     vector<Molecule> ret;
     ifstream file(filename);
@@ -429,41 +474,33 @@ vector<Molecule> loadSdf(string filename) {
         cout << "loadSdf: can\'t open the file \"" << filename << "\"";
         exit(-1);
     }
+    Molecule mol;
+    while (readSdfRecord(file, mol)) {
+        ret.push_back(mol);
+    }
+    return ret;
+}
+
+// загружает записи sdf файла, которые начинаются в байтах [begin, end). Запись начинается
+// в начале файла или сразу после строки "$$$$", поэтому читается только свой кусок файла
+// (плюс хвост последней записи), а соседние диапазоны делят записи без пропусков и повторов
+vector<Molecule> loadSdfBytes(string filename, long long begin, long long end) {
+    vector<Molecule> ret;
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "loadSdfBytes: can\'t open the file \"" << filename << "\"";
+        exit(-1);
+    }
     string line;
-    stringstream ss;
-    while (!file.eof()) {
-        Molecule mol;
-        int bondCount;
-        getline(file, line);
-        if (line == "") {
-            break;
-        }
-        mol.name = line;
+    if (begin > 0) {
+        // чуть раньше begin, чтобы не пропустить "$$$$", которая кончается ровно на begin
+        file.seekg(max(0LL, begin - 16));
         getline(file, line);
-        getline(file, line);
-        getline(file, line);
-        ss.str(line);
-        ss >> mol.atomCount >> bondCount;
-        for (int i = 0; i < mol.atomCount; i++) {
-            Atom a;
-            a.hydrogenCount = 0;
-            getline(file, line);
-            ss.str(line);
-            ss >> a.x >> a.y >> a.z >> a.name;
-            a.index = i;
-            mol.atoms.push_back(a);
-        }
-        for (int i = 0; i < bondCount; i++) {
-            Link l;
-            getline(file, line);
-            ss.str(line);
-            ss >> l.fst >> l.snd >> l.type;
-            l.fst--;
-            l.snd--;
-            mol.links.push_back(l);
-        }
+        while (getline(file, line) && !(line == "$$$$" && (long long)file.tellg() >= begin));
+    }
+    Molecule mol;
+    while (file && (long long)file.tellg() < end && readSdfRecord(file, mol)) {
         ret.push_back(mol);
-        while (getline(file, line) && line != "$$$$");
     }
     return ret;
 }
@@ -676,7 +713,796 @@ public:
     }
 };
 
-int main() {
+// Шардированный режим: каждый процесс обрабатывает свой диапазон байт sdf файла
+// и пишет в <folder>/shard<i>/ для каждого набора (k, m):
+//     vocab<km>.txt - отсортированный словарь цепочек шарда ("цепочка кол-во" в строке),
+//                     локальный id цепочки = номер строки
+//     vecs<km>.txt  - "молекул first last total shardCount" (диапазон байт шарда, размер
+//                     файла и кол-во шардов), затем для каждой молекулы: имя и строка
+//                     "n id:кол-во id:кол-во ..." с локальными id
+// Затем mergeShards делает k-путевое слияние словарей в глобальный порядок столбцов
+// (тот же, что у createAllChains) и переводит шарды в разреженную матрицу.
+
+const vector<pair<int, int>> shardConfigs = {{2, 1}, {3, 1}, {2, 2}, {3, 2}, {2, 3}, {3, 3}};
+
+string configName(int K, int markers) {
+    return "k" + to_string(K) + "m" + to_string(markers);
+}
+
+string shardFolder(string folder, int shardIndex) {
+    return folder + "/shard" + to_string(shardIndex);
+}
+
+// размер файла в байтах
+long long fileSize(string filename) {
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file.is_open()) {
+        cout << "fileSize: can\'t open the file \"" << filename << "\"";
+        exit(-1);
+    }
+    return (long long)file.tellg();
+}
+
+class MolShard {
+public:
+    string folder;
+    int shardIndex, shardCount;
+    long long first, last, total;
+    vector<Molecule> mols;
+
+    // shardIndex-ый из shardCount равных диапазонов байт файла
+    MolShard(string _filename, string _folder, int _shardIndex, int _shardCount) {
+        folder = shardFolder(_folder, _shardIndex);
+        shardIndex = _shardIndex;
+        shardCount = _shardCount;
+        total = fileSize(_filename);
+        first = total * shardIndex / shardCount;
+        last = total * (shardIndex + 1) / shardCount;
+        mols = loadSdfBytes(_filename, first, last);
+        LOG(shardIndex, first, last, mols.size());
+    }
+
+    void saveConfig(int K, int markers) {
+        markerCount = markers;
+        vector<map<string, int>> lists;
+        map<string, int> vocab;
+        for (auto& mol : mols) {
+            lists.push_back(mol.createList(K));
+            for (auto& it : lists.back()) {
+                vocab[it.first] += it.second;
+            }
+        }
+
+        ofstream vocabFile(folder + "/vocab" + configName(K, markers) + ".txt");
+        ofstream vecsFile(folder + "/vecs" + configName(K, markers) + ".txt");
+        if (!vocabFile.is_open() || !vecsFile.is_open()) {
+            cout << "MolShard::saveConfig: can\'t open files in \"" << folder << "\"";
+            exit(-1);
+        }
+
+        map<string, int> localIds;
+        int localId = 0;
+        for (auto& it : vocab) {
+            localIds[it.first] = localId++;
+            vocabFile << it.first << " " << it.second << "\n";
+        }
+
+        vecsFile << mols.size() << " " << first << " " << last << " " << total << " " << shardCount << "\n";
+        for (unsigned i = 0; i < mols.size(); i++) {
+            vecsFile << mols[i].name << "\n" << lists[i].size();
+            for (auto& it : lists[i]) {
+                vecsFile << " " << localIds[it.first] << ":" << it.second;
+            }
+            vecsFile << "\n";
+        }
+    }
+
+    void save() {
+        system((string("mkdir -p ") + folder).c_str());
+        for (auto& config : shardConfigs) {
+            saveConfig(config.first, config.second);
+        }
+    }
+};
+
+// Слияние словарей шардов для одного (K, m). Словари читаются построчно, в памяти
+// только по одной строке на шард. Для каждого шарда пишется remap<km>.txt -
+// глобальный id для каждого локального (по строке на id). Пишет allChains<km>.txt
+// (как MolFiles::saveAllChains) и sparse<km>.txt: "строк столбцов", затем тройки
+// "молекула столбец кол-во".
+void mergeShardConfig(string folder, int shardCount, int K, int markers) {
+    string name = configName(K, markers);
+    vector<ifstream> vocabFiles(shardCount);
+    vector<ofstream> remapFiles(shardCount);
+    for (int s = 0; s < shardCount; s++) {
+        vocabFiles[s].open(shardFolder(folder, s) + "/vocab" + name + ".txt");
+        remapFiles[s].open(shardFolder(folder, s) + "/remap" + name + ".txt");
+        if (!vocabFiles[s].is_open() || !remapFiles[s].is_open()) {
+            cout << "mergeShardConfig: can\'t open files of shard " << s << " in \"" << folder << "\"";
+            exit(-1);
+        }
+    }
+
+    // (цепочка, шард), кол-во хранится отдельно
+    priority_queue<pair<string, int>, vector<pair<string, int>>, greater<pair<string, int>>> heap;
+    vector<int> counts(shardCount);
+    string chain;
+    for (int s = 0; s < shardCount; s++) {
+        if (vocabFiles[s] >> chain >> counts[s]) {
+            heap.push({chain, s});
+        }
+    }
+
+    ofstream allChainsFile(folder + "/allChains" + name + ".txt");
+    allChainsFile << "{";
+    int columns = 0;
+    while (!heap.empty()) {
+        string current = heap.top().first;
+        int total = 0;
+        while (!heap.empty() && heap.top().first == current) {
+            int s = heap.top().second;
+            heap.pop();
+            total += counts[s];
+            remapFiles[s] << columns << "\n";
+            if (vocabFiles[s] >> chain >> counts[s]) {
+                heap.push({chain, s});
+            }
+        }
+        if (columns > 0) {
+            allChainsFile << ", ";
+        }
+        allChainsFile << current << ": " << total;
+        columns++;
+    }
+    allChainsFile << "}";
+    for (auto& file : remapFiles) {
+        file.close();
+    }
+
+    vector<ifstream> vecsFiles(shardCount);
+    vector<int> molCounts(shardCount);
+    int rows = 0;
+    long long expectedFirst = 0, fileTotal = -1;
+    for (int s = 0; s < shardCount; s++) {
+        vecsFiles[s].open(shardFolder(folder, s) + "/vecs" + name + ".txt");
+        long long first, last, total;
+        int writtenShardCount;
+        if (!vecsFiles[s].is_open() || !(vecsFiles[s] >> molCounts[s] >> first >> last >> total >> writtenShardCount)) {
+            cout << "mergeShardConfig: can\'t read vecs" << name << ".txt of shard " << s << " in \"" << folder << "\"";
+            exit(-1);
+        }
+        // шарды должны быть из одного запуска и покрывать файл подряд от 0 до конца
+        if (writtenShardCount != shardCount || first != expectedFirst || (fileTotal >= 0 && total != fileTotal)
+                || (s == shardCount - 1 && last != total)) {
+            cout << "mergeShardConfig: shard " << s << " covers bytes [" << first << ", " << last << ") of "
+                 << total << " in a run of " << writtenShardCount << " shards, expected to start at "
+                 << expectedFirst << " in a run of " << shardCount << " shards";
+            exit(-1);
+        }
+        expectedFirst = last;
+        fileTotal = total;
+        rows += molCounts[s];
+    }
+
+    ofstream sparseFile(folder + "/sparse" + name + ".txt");
+    sparseFile << rows << " " << columns << "\n";
+    int row = 0;
+    for (int s = 0; s < shardCount; s++) {
+        int shardFirstRow = row;
+        // в памяти только отображение id одного шарда
+        vector<int> remap;
+        ifstream remapFile(shardFolder(folder, s) + "/remap" + name + ".txt");
+        int globalId;
+        while (remapFile >> globalId) {
+            remap.push_back(globalId);
+        }
+
+        string line;
+        getline(vecsFiles[s], line);
+        while (getline(vecsFiles[s], line) && getline(vecsFiles[s], line)) {
+            stringstream ss(line);
+            int n;
+            ss >> n;
+            for (int i = 0; i < n; i++) {
+                int localId, count;
+                char _;
+                if (!(ss >> localId >> _ >> count) || localId < 0 || localId >= int(remap.size())) {
+                    cout << "mergeShardConfig: bad chain " << i << " of molecule " << row - shardFirstRow
+                         << " in vecs" << name << ".txt of shard " << s << " (" << remap.size() << " chains in vocab)";
+                    exit(-1);
+                }
+                sparseFile << row << " " << remap[localId] << " " << count << "\n";
+            }
+            row++;
+        }
+        // упавший или недописанный шард не должен тихо терять строки
+        if (row - shardFirstRow != molCounts[s]) {
+            cout << "mergeShardConfig: shard " << s << " has " << row - shardFirstRow << " of "
+                 << molCounts[s] << " molecules in vecs" << name << ".txt";
+            exit(-1);
+        }
+    }
+    LOG(name, rows, columns);
+}
+
+void mergeShards(string folder, int shardCount) {
+    for (auto& config : shardConfigs) {
+        mergeShardConfig(folder, shardCount, config.first, config.second);
+    }
+}
+
+// Экспорт 3D сцен (ball-and-stick) по координатам Molecule, формат как в TestMoleculaFormat:
+//     wrl  - VRML 1.0, атомы/связи в Separator/Transform с DEF sphere/cylinder и USE,
+//            материалы элементов DEF один раз, фигуры сгруппированы по материалу
+//     json - opaqueSpheres/cylinders с массивами vertices/starts/ends/colors/radii/ids
+//     xyz  - все молекулы подряд в одном файле
+//     glb  - бинарный glTF 2.0, одна сфера и один цилиндр на файл, экземпляры через
+//            EXT_mesh_gpu_instancing, материал на элемент
+// Каждая молекула сначала собирается в строку и пишется одним вызовом write,
+// молекулы обрабатываются параллельно.
+
+const float atomRadius = 0.2f;
+const float singleBondRadius = 0.2f;
+const float multiBondRadius = 0.08f;
+const float multiBondOffset = 0.1f;
+
+struct Vec3 {
+    float x, y, z;
+};
+
+Vec3 operator+(Vec3 a, Vec3 b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+Vec3 operator-(Vec3 a, Vec3 b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+Vec3 operator*(Vec3 a, float k) { return {a.x * k, a.y * k, a.z * k}; }
+float dot(Vec3 a, Vec3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+Vec3 cross(Vec3 a, Vec3 b) { return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x}; }
+float length(Vec3 a) { return sqrt(dot(a, a)); }
+
+// материал элемента, цвет в 0..255 как в именах mat_R_G_B
+struct ElementMaterial {
+    int index;
+    int r, g, b;
+    string name;        // mat_R_G_B
+    string jsonColor;   // уже отформатированный цвет для json
+};
+
+// таблица материалов: одинаковые цвета разных элементов дают один материал
+class MaterialTable {
+public:
+    vector<ElementMaterial> materials;
+
+    const ElementMaterial& materialFor(const string& element) {
+        int r, g, b;
+        elementColor(element, r, g, b);
+        for (auto& it : materials) {
+            if (it.r == r && it.g == g && it.b == b) {
+                return it;
+            }
+        }
+        ElementMaterial m;
+        m.index = materials.size();
+        m.r = r; m.g = g; m.b = b;
+        m.name = "mat_" + to_string(r) + "_" + to_string(g) + "_" + to_string(b);
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.2f,%.2f,%.2f", r / 255.0, g / 255.0, b / 255.0);
+        m.jsonColor = buf;
+        materials.push_back(m);
+        return materials.back();
+    }
+
+    static void elementColor(const string& element, int& r, int& g, int& b) {
+        static const map<string, vector<int>> colors = {
+            {"C",  {146, 146, 146}}, {"H",  {255, 255, 255}}, {"N",  {48, 80, 248}},
+            {"O",  {255, 13, 13}},   {"S",  {255, 255, 48}},  {"P",  {255, 128, 0}},
+            {"F",  {144, 224, 80}},  {"Cl", {31, 240, 31}},   {"Br", {166, 41, 41}},
+            {"I",  {148, 0, 148}},
+        };
+        auto it = colors.find(element);
+        vector<int> c = it != colors.end() ? it->second : vector<int>{255, 20, 147};
+        r = c[0]; g = c[1]; b = c[2];
+    }
+};
+
+struct SceneSphere {
+    Vec3 center;
+    float radius;
+    int material;
+    int id;
+};
+
+struct SceneCylinder {
+    Vec3 start, end;
+    float radius;
+    int material;
+    int id;
+};
+
+// геометрия ball-and-stick: сфера на атом, цилиндр на связь (двойные и тройные -
+// несколько тонких цилиндров), связь разных элементов делится пополам по цветам
+struct Scene {
+    string name;
+    vector<SceneSphere> spheres;
+    vector<SceneCylinder> cylinders;
+
+    Scene(const Molecule& mol, const vector<int>& atomMaterials) {
+        name = mol.name;
+        for (auto& a : mol.atoms) {
+            spheres.push_back({{a.x, a.y, a.z}, atomRadius, atomMaterials[a.index], a.index + 1});
+        }
+        int bondId = mol.atomCount + 1;
+        for (auto& l : mol.links) {
+            addBond(mol, l, atomMaterials, bondId++);
+        }
+    }
+
+    void addBond(const Molecule& mol, const Link& l, const vector<int>& atomMaterials, int id) {
+        Vec3 a = {mol.atoms[l.fst].x, mol.atoms[l.fst].y, mol.atoms[l.fst].z};
+        Vec3 b = {mol.atoms[l.snd].x, mol.atoms[l.snd].y, mol.atoms[l.snd].z};
+        int count = l.type == 2 || l.type == 4 ? 2 : l.type == 3 ? 3 : 1;
+        float radius = count == 1 ? singleBondRadius : multiBondRadius;
+        Vec3 side = bondSide(mol, l, b - a) * multiBondOffset;
+        for (int i = 0; i < count; i++) {
+            Vec3 shift = side * (i - (count - 1) / 2.0f) * (count == 3 ? 1.5f : 2.0f);
+            Vec3 start = a + shift, end = b + shift;
+            int ma = atomMaterials[l.fst], mb = atomMaterials[l.snd];
+            if (ma == mb) {
+                cylinders.push_back({start, end, radius, ma, id});
+            } else {
+                Vec3 middle = (start + end) * 0.5f;
+                cylinders.push_back({start, middle, radius, ma, id});
+                cylinders.push_back({middle, end, radius, mb, id});
+            }
+        }
+    }
+
+    // единичный вектор, перпендикулярный связи, по возможности в плоскости соседнего атома
+    static Vec3 bondSide(const Molecule& mol, const Link& l, Vec3 dir) {
+        Vec3 side = {0, 0, 0};
+        for (auto& it : mol.links) {
+            int other = it.fst == l.fst && it.snd != l.snd ? it.snd
+                      : it.snd == l.fst && it.fst != l.snd ? it.fst : -1;
+            if (other >= 0) {
+                Vec3 v = Vec3{mol.atoms[other].x, mol.atoms[other].y, mol.atoms[other].z}
+                       - Vec3{mol.atoms[l.fst].x, mol.atoms[l.fst].y, mol.atoms[l.fst].z};
+                side = v - dir * (dot(v, dir) / dot(dir, dir));
+                break;
+            }
+        }
+        if (length(side) < 1e-4f) {
+            side = cross(dir, fabs(dir.z) < 0.9f * length(dir) ? Vec3{0, 0, 1} : Vec3{1, 0, 0});
+        }
+        return side * (1.0f / length(side));
+    }
+};
+
+// поворот оси Y на направление dir (ось и угол)
+void rotationFromY(Vec3 dir, Vec3& axis, float& angle) {
+    Vec3 d = dir * (1.0f / length(dir));
+    axis = {d.z, 0, -d.x};
+    angle = acos(max(-1.0f, min(1.0f, d.y)));
+    if (length(axis) < 1e-6f) {
+        axis = {1, 0, 0};
+    } else {
+        axis = axis * (1.0f / length(axis));
+    }
+}
+
+// дописывает в out по формату printf; длинный результат форматируется прямо в out
+template <typename ... Args>
+void appendf(string& out, const char* format, const Args&... args) {
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), format, args...);
+    if (n < 0) {
+        cout << "appendf: can\'t format \"" << format << "\"";
+        exit(-1);
+    }
+    if (n < int(sizeof(buf))) {
+        out.append(buf, n);
+        return;
+    }
+    size_t size = out.size();
+    out.resize(size + n + 1);
+    snprintf(&out[size], n + 1, format, args...);
+    out.resize(size + n);
+}
+
+// экранирует строку для строкового литерала json: кавычки, \\ и управляющие символы
+string escapeJsonString(const string& value) {
+    string ret;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if ((unsigned char)c < 0x20) {
+            appendf(ret, "\\u%04x", int(c));
+        } else {
+            ret += c;
+        }
+    }
+    return ret;
+}
+
+// экранирует строку для строкового литерала vrml: там есть только \" и \\,
+// поэтому управляющие символы заменяются пробелом
+string escapeVrmlString(const string& value) {
+    string ret;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if ((unsigned char)c < 0x20) {
+            ret += ' ';
+        } else {
+            ret += c;
+        }
+    }
+    return ret;
+}
+
+void writeXyz(string& out, const Molecule& mol) {
+    appendf(out, "%d\n%s  0.000000\n", mol.atomCount, mol.name.c_str());
+    for (auto& a : mol.atoms) {
+        appendf(out, "%s %7.4f %7.4f %7.4f\n", a.name.c_str(), a.x, a.y, a.z);
+    }
+}
+
+void writeVrml(string& out, const Scene& scene, const MaterialTable& table) {
+    out += "#VRML V1.0 ascii\nSeparator {\n"
+           "DEF Title Info { \nstring \"" + escapeVrmlString(scene.name) + "\" \n} \n"
+           "ShapeHints { \nvertexOrdering UNKNOWN_ORDERING \nshapeType UNKNOWN_SHAPE_TYPE \nfaceType CONVEX \n} \n";
+
+    bool sphereDefined = false, cylinderDefined = false;
+    for (auto& m : table.materials) {
+        bool used = false;
+        for (auto& s : scene.spheres) used = used || s.material == m.index;
+        for (auto& c : scene.cylinders) used = used || c.material == m.index;
+        if (!used) continue;
+
+        appendf(out, "\nDEF  %s Material {\ndiffuseColor %.3f %.3f %.3f\n"
+                     "ambientColor 0.2 0.2 0.2 \nspecularColor 0.8 0.8 0.8 \nshininess 0.2 \n} \n",
+                m.name.c_str(), m.r / 255.0, m.g / 255.0, m.b / 255.0);
+
+        for (auto& s : scene.spheres) {
+            if (s.material != m.index) continue;
+            appendf(out, "\nSeparator {\nTransform {\ntranslation %f %f %f \nscaleFactor %f %f %f \n} \n",
+                    s.center.x, s.center.y, s.center.z, s.radius, s.radius, s.radius);
+            out += sphereDefined ? "USE sphere \n} \n" : "DEF sphere Sphere {} \n} \n";
+            sphereDefined = true;
+        }
+        for (auto& c : scene.cylinders) {
+            if (c.material != m.index) continue;
+            Vec3 axis;
+            float angle;
+            rotationFromY(c.end - c.start, axis, angle);
+            Vec3 middle = (c.start + c.end) * 0.5f;
+            appendf(out, "\nSeparator {\nTransform {\ntranslation %f %f %f \nrotation  %f %f %f  %f \n"
+                         "scaleFactor %f %f %f \n} \n",
+                    middle.x, middle.y, middle.z, axis.x, axis.y, axis.z, angle,
+                    c.radius, length(c.end - c.start), c.radius);
+            out += cylinderDefined ? "USE cylinder \n} \n" : "DEF cylinder Cylinder { \nparts SIDES \nheight 1\n} \n} \n";
+            cylinderDefined = true;
+        }
+    }
+    out += "\n} \n";
+}
+
+void writeJsonFloats(string& out, const char* key, const vector<float>& values) {
+    out += "        \"";
+    out += key;
+    out += "\" : [";
+    for (unsigned i = 0; i < values.size(); i++) {
+        appendf(out, i ? ",%.3f" : "%.3f", values[i]);
+    }
+    out += "],\n";
+}
+
+void writeJson(string& out, const Scene& scene, const MaterialTable& table) {
+    vector<float> vertices, radii, starts, ends;
+    string sphereColors, sphereIds, cylinderColors, cylinderIds, cylinderRadii;
+    for (auto& s : scene.spheres) {
+        vertices.insert(vertices.end(), {s.center.x, s.center.y, s.center.z});
+        radii.push_back(s.radius);
+        sphereColors += (sphereColors.empty() ? "" : ",") + table.materials[s.material].jsonColor;
+        sphereIds += (sphereIds.empty() ? "" : ",") + to_string(s.id);
+    }
+    for (auto& c : scene.cylinders) {
+        starts.insert(starts.end(), {c.start.x, c.start.y, c.start.z});
+        ends.insert(ends.end(), {c.end.x, c.end.y, c.end.z});
+        appendf(cylinderRadii, cylinderRadii.empty() ? "%g" : ",%g", c.radius);
+        cylinderColors += (cylinderColors.empty() ? "" : ",") + table.materials[c.material].jsonColor;
+        cylinderIds += (cylinderIds.empty() ? "" : ",") + to_string(c.id);
+    }
+
+    out += "{\n    \"opaqueSpheres\" : {\n";
+    writeJsonFloats(out, "vertices", vertices);
+    out += "        \"colors\" : [" + sphereColors + "],\n";
+    out += "        \"radii\" : [";
+    for (unsigned i = 0; i < radii.size(); i++) {
+        appendf(out, i ? ",%g" : "%g", radii[i]);
+    }
+    out += "],\n        \"ids\" : [" + sphereIds + "]\n    },\n";
+    out += "    \"cylinders\" : {\n";
+    writeJsonFloats(out, "starts", starts);
+    writeJsonFloats(out, "ends", ends);
+    out += "        \"colors\" : [" + cylinderColors + "],\n";
+    out += "        \"radii\" : [" + cylinderRadii + "],\n";
+    out += "        \"ids\" : [" + cylinderIds + "]\n    },\n";
+    out += "    \"meshes\" : [\n    ]\n}\n";
+}
+
+// бинарный буфер glb: данные выравниваются на 4 байта, как требует glTF
+struct GlbBuffer {
+    string data;
+    string bufferViews;
+    string accessors;
+    int viewCount = 0;
+    int accessorCount = 0;
+
+    int addFloats(const vector<float>& values, const char* type, int components, bool minMax = false) {
+        int offset = data.size();
+        data.append((const char*)values.data(), values.size() * sizeof(float));
+        appendf(bufferViews, "%s{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d}",
+                viewCount ? "," : "", offset, int(values.size() * sizeof(float)));
+        appendf(accessors, "%s{\"bufferView\":%d,\"componentType\":5126,\"count\":%d,\"type\":\"%s\"",
+                accessorCount ? "," : "", viewCount, int(values.size()) / components, type);
+        if (minMax) {
+            float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+            for (unsigned i = 0; i < values.size(); i++) {
+                lo[i % 3] = min(lo[i % 3], values[i]);
+                hi[i % 3] = max(hi[i % 3], values[i]);
+            }
+            appendf(accessors, ",\"min\":[%g,%g,%g],\"max\":[%g,%g,%g]", lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+        }
+        accessors += "}";
+        viewCount++;
+        return accessorCount++;
+    }
+
+    int addIndices(const vector<uint16_t>& values) {
+        int offset = data.size();
+        data.append((const char*)values.data(), values.size() * sizeof(uint16_t));
+        data.resize((data.size() + 3) / 4 * 4, '\0');
+        appendf(bufferViews, "%s{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d,\"target\":34963}",
+                viewCount ? "," : "", offset, int(values.size() * sizeof(uint16_t)));
+        appendf(accessors, "%s{\"bufferView\":%d,\"componentType\":5123,\"count\":%d,\"type\":\"SCALAR\"}",
+                accessorCount ? "," : "", viewCount, int(values.size()));
+        viewCount++;
+        return accessorCount++;
+    }
+};
+
+// единичная сфера (radius 1) и цилиндр (radius 1, height 1 вдоль Y), только боковая поверхность
+void unitSphere(vector<float>& positions, vector<float>& normals, vector<uint16_t>& indices) {
+    const int rings = 12, segments = 24;
+    for (int i = 0; i <= rings; i++) {
+        float theta = M_PI * i / rings;
+        for (int k = 0; k <= segments; k++) {
+            float phi = 2 * M_PI * k / segments;
+            Vec3 p = {sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)};
+            positions.insert(positions.end(), {p.x, p.y, p.z});
+            normals.insert(normals.end(), {p.x, p.y, p.z});
+        }
+    }
+    for (int i = 0; i < rings; i++) {
+        for (int k = 0; k < segments; k++) {
+            uint16_t a = i * (segments + 1) + k, b = a + segments + 1;
+            indices.insert(indices.end(), {a, uint16_t(a + 1), b, b, uint16_t(a + 1), uint16_t(b + 1)});
+        }
+    }
+}
+
+void unitCylinder(vector<float>& positions, vector<float>& normals, vector<uint16_t>& indices) {
+    const int segments = 24;
+    for (int k = 0; k <= segments; k++) {
+        float phi = 2 * M_PI * k / segments;
+        float x = cos(phi), z = sin(phi);
+        positions.insert(positions.end(), {x, -0.5f, z, x, 0.5f, z});
+        normals.insert(normals.end(), {x, 0, z, x, 0, z});
+    }
+    for (int k = 0; k < segments; k++) {
+        uint16_t a = 2 * k;
+        indices.insert(indices.end(), {a, uint16_t(a + 1), uint16_t(a + 2), uint16_t(a + 2), uint16_t(a + 1), uint16_t(a + 3)});
+    }
+}
+
+void writeGlb(string& out, const Scene& scene, const MaterialTable& table) {
+    GlbBuffer buffer;
+    vector<float> positions, normals;
+    vector<uint16_t> indices;
+    unitSphere(positions, normals, indices);
+    int spherePos = buffer.addFloats(positions, "VEC3", 3, true);
+    int sphereNorm = buffer.addFloats(normals, "VEC3", 3);
+    int sphereIdx = buffer.addIndices(indices);
+    positions.clear(); normals.clear(); indices.clear();
+    unitCylinder(positions, normals, indices);
+    int cylinderPos = buffer.addFloats(positions, "VEC3", 3, true);
+    int cylinderNorm = buffer.addFloats(normals, "VEC3", 3);
+    int cylinderIdx = buffer.addIndices(indices);
+
+    string materials, meshes, nodes, sceneNodes;
+    for (auto& m : table.materials) {
+        appendf(materials, "%s{\"name\":\"%s\",\"pbrMetallicRoughness\":{\"baseColorFactor\":[%.3f,%.3f,%.3f,1],"
+                           "\"metallicFactor\":0,\"roughnessFactor\":0.6}}",
+                m.index ? "," : "", m.name.c_str(), m.r / 255.0, m.g / 255.0, m.b / 255.0);
+    }
+
+    // по узлу с экземплярами на каждую пару (фигура, материал)
+    int meshCount = 0;
+    for (int shape = 0; shape < 2; shape++) {
+        for (auto& m : table.materials) {
+            vector<float> translations, rotations, scales;
+            if (shape == 0) {
+                for (auto& s : scene.spheres) {
+                    if (s.material != m.index) continue;
+                    translations.insert(translations.end(), {s.center.x, s.center.y, s.center.z});
+                    rotations.insert(rotations.end(), {0, 0, 0, 1});
+                    scales.insert(scales.end(), {s.radius, s.radius, s.radius});
+                }
+            } else {
+                for (auto& c : scene.cylinders) {
+                    if (c.material != m.index) continue;
+                    Vec3 axis, middle = (c.start + c.end) * 0.5f;
+                    float angle;
+                    rotationFromY(c.end - c.start, axis, angle);
+                    float sn = sin(angle / 2);
+                    translations.insert(translations.end(), {middle.x, middle.y, middle.z});
+                    rotations.insert(rotations.end(), {axis.x * sn, axis.y * sn, axis.z * sn, float(cos(angle / 2))});
+                    scales.insert(scales.end(), {c.radius, length(c.end - c.start), c.radius});
+                }
+            }
+            if (translations.empty()) continue;
+
+            int t = buffer.addFloats(translations, "VEC3", 3);
+            int r = buffer.addFloats(rotations, "VEC4", 4);
+            int s = buffer.addFloats(scales, "VEC3", 3);
+            appendf(meshes, "%s{\"primitives\":[{\"attributes\":{\"POSITION\":%d,\"NORMAL\":%d},\"indices\":%d,\"material\":%d}]}",
+                    meshCount ? "," : "", shape ? cylinderPos : spherePos, shape ? cylinderNorm : sphereNorm,
+                    shape ? cylinderIdx : sphereIdx, m.index);
+            appendf(nodes, "%s{\"mesh\":%d,\"extensions\":{\"EXT_mesh_gpu_instancing\":{\"attributes\":"
+                           "{\"TRANSLATION\":%d,\"ROTATION\":%d,\"SCALE\":%d}}}}",
+                    meshCount ? "," : "", meshCount, t, r, s);
+            appendf(sceneNodes, meshCount ? ",%d" : "%d", meshCount);
+            meshCount++;
+        }
+    }
+
+    string json = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"NewHimia\"},"
+                  "\"extensionsUsed\":[\"EXT_mesh_gpu_instancing\"],\"extensionsRequired\":[\"EXT_mesh_gpu_instancing\"],"
+                  "\"scene\":0,\"scenes\":[{\"name\":\"" + escapeJsonString(scene.name) + "\",\"nodes\":[" + sceneNodes + "]}],"
+                  "\"nodes\":[" + nodes + "],\"meshes\":[" + meshes + "],\"materials\":[" + materials + "],"
+                  "\"accessors\":[" + buffer.accessors + "],\"bufferViews\":[" + buffer.bufferViews + "],"
+                  "\"buffers\":[{\"byteLength\":" + to_string(buffer.data.size()) + "}]}";
+    json.resize((json.size() + 3) / 4 * 4, ' ');
+
+    auto put32 = [&out](uint32_t value) { out.append((const char*)&value, 4); };
+    put32(0x46546C67);  // "glTF"
+    put32(2);
+    put32(12 + 8 + json.size() + 8 + buffer.data.size());
+    put32(json.size());
+    put32(0x4E4F534A);  // "JSON"
+    out += json;
+    put32(buffer.data.size());
+    put32(0x004E4942);  // "BIN\0"
+    out += buffer.data;
+}
+
+// имя файла молекулы: номер и имя без символов, недопустимых в путях; имя обрезается,
+// чтобы не упереться в ограничение длины имени файла (номер и так уникален)
+string sceneFilename(const Molecule& mol, int index, const string& format) {
+    string name = mol.name.substr(0, 100);
+    for (auto& c : name) {
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') c = '_';
+    }
+    return to_string(index) + "_" + name + "." + format;
+}
+
+void exportScenes(const vector<Molecule>& mols, string folder, string format, int threadCount) {
+    if (format != "wrl" && format != "json" && format != "xyz" && format != "glb") {
+        cout << "exportScenes: unknown format \"" << format << "\"";
+        exit(-1);
+    }
+    system((string("mkdir -p ") + folder).c_str());
+
+    // материалы заводятся заранее, чтобы потоки только читали таблицу
+    MaterialTable table;
+    vector<vector<int>> atomMaterials(mols.size());
+    for (unsigned i = 0; i < mols.size(); i++) {
+        for (auto& a : mols[i].atoms) {
+            atomMaterials[i].push_back(table.materialFor(a.name).index);
+        }
+    }
+
+    // xyz пишется в один файл, поэтому молекулы идут пачками и сбрасываются по порядку
+    bool single = format == "xyz";
+    ofstream singleFile;
+    if (single) {
+        singleFile.open(folder + "/molecules.xyz", ios::binary);
+        if (!singleFile.is_open()) {
+            cout << "exportScenes: can\'t open the file \"" << folder << "/molecules.xyz\"";
+            exit(-1);
+        }
+    }
+    const int batchSize = single ? 1024 : int(mols.size());
+    vector<string> batch(single ? batchSize : 0);
+    // первая молекула, файл которой не удалось записать; exit из рабочего потока
+    // запустил бы деструкторы при живых потоках, поэтому ошибку выдаёт главный поток
+    atomic<int> failedMolecule(-1);
+
+    for (int first = 0; first < int(mols.size()); first += batchSize) {
+        int last = min(int(mols.size()), first + batchSize);
+        atomic<int> next(first);
+        auto worker = [&]() {
+            string out;
+            for (int i = next++; i < last && failedMolecule < 0; i = next++) {
+                out.clear();
+                if (format == "xyz") {
+                    writeXyz(out, mols[i]);
+                    batch[i - first].swap(out);
+                    continue;
+                }
+                Scene scene(mols[i], atomMaterials[i]);
+                if (format == "wrl") writeVrml(out, scene, table);
+                else if (format == "json") writeJson(out, scene, table);
+                else writeGlb(out, scene, table);
+                string filename = folder + "/" + sceneFilename(mols[i], i, format);
+                ofstream file(filename, ios::binary);
+                if (!file.is_open() || !file.write(out.data(), out.size())) {
+                    int none = -1;
+                    failedMolecule.compare_exchange_strong(none, i);
+                    return;
+                }
+            }
+        };
+        vector<thread> threads;
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back(worker);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        if (failedMolecule >= 0) {
+            cout << "exportScenes: can\'t write the file \"" << folder << "/"
+                 << sceneFilename(mols[failedMolecule], failedMolecule, format) << "\"";
+            exit(-1);
+        }
+        if (single) {
+            for (int i = first; i < last; i++) {
+                singleFile.write(batch[i - first].data(), batch[i - first].size());
+            }
+            if (!singleFile) {
+                cout << "exportScenes: can\'t write the file \"" << folder << "/molecules.xyz\"";
+                exit(-1);
+            }
+        }
+    }
+    LOG(format, mols.size(), table.materials.size());
+}
+
+// без аргументов:                       старый режим (er_lit_3d/er_lit_3d.sdf -> folder)
+// shard <file.sdf> <folder> <i> <n>:   обработать i-ый из n шардов
+// merge <folder> <n>:                   слить n шардов из folder
+// export <file> <folder> <fmt> [t]:    сцены wrl/json/xyz/glb в t потоков
+int main(int argc, char** argv) {
+    if (argc == 6 && string(argv[1]) == "shard" && stoi(argv[5]) >= 1
+            && stoi(argv[4]) >= 0 && stoi(argv[4]) < stoi(argv[5])) {
+        MolShard shard(argv[2], argv[3], stoi(argv[4]), stoi(argv[5]));
+        shard.save();
+        return 0;
+    }
+    if (argc == 4 && string(argv[1]) == "merge" && stoi(argv[3]) >= 1) {
+        mergeShards(argv[2], stoi(argv[3]));
+        return 0;
+    }
+    if ((argc == 5 || (argc == 6 && stoi(argv[5]) >= 1)) && string(argv[1]) == "export") {
+        int threadCount = argc == 6 ? stoi(argv[5]) : max(1, int(thread::hardware_concurrency()));
+        exportScenes(load(argv[2]), argv[3], argv[4], threadCount);
+        return 0;
+    }
+    if (argc != 1) {
+        cout << "usage: " << argv[0] << " [shard <file.sdf> <folder> <i> <n> | merge <folder> <n>"
+             << " | export <file> <folder> <wrl|json|xyz|glb> [threads]]";
+        return -1;
+    }
+
     MolFiles molFiles("er_lit_3d/er_lit_3d.sdf");
     molFiles.save();
     